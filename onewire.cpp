@@ -18,9 +18,16 @@
 			FET is supported after write cycles. If
 			used the application has to disable active
 			pullup prior to next use of the bus.
+
+		ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+			If defined write slots and the reset sequence
+			only disable interrupts during their timing
+			critical parts. Preempted slots and presence
+			detections are detected and reported.
 */
 
 #include <stdint.h>
+#include <string.h>
 
 #include "./onewire.h"
 
@@ -43,6 +50,19 @@ InterfaceOneWire::InterfaceOneWire(uint8_t ioPin, uint8_t activePullupPin) {
 		}
 	#endif
 
+	#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+		this->slotPreempted = false;
+	#endif
+
+	this->recordedPowerMode = ONEWIRE_POWERMODE_UNKNOWN;
+	#if ONEWIRE_POWERMODE_CACHE_SIZE > 0
+		for(uint8_t i = 0; i < ONEWIRE_POWERMODE_CACHE_SIZE; i=i+1) {
+			memset(this->powerModeCacheRom[i], 0, 8);
+			this->powerModeCacheMode[i] = ONEWIRE_POWERMODE_UNKNOWN;
+		}
+		this->powerModeCacheNext = 0;
+	#endif
+
 	/* Setup pins */
 	pinHigh();
 	pinModeInput();
@@ -80,6 +100,10 @@ InterfaceOneWire::~InterfaceOneWire() {
 bool InterfaceOneWire::resetAndPresenceDetection() {
 	uint8_t retryCount;
 	uint8_t result;
+	#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+		unsigned long releaseTime;
+		unsigned long releaseElapsed;
+	#endif
 
 	noInterrupts();
 
@@ -93,9 +117,13 @@ bool InterfaceOneWire::resetAndPresenceDetection() {
 		or defect pullup, a short circuit, etc.
 	*/
 	pinModeInput();
+	#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+		interrupts();						/* Waiting for idle is not timing critical */
+	#endif
 	retryCount = ONEWIRE_RETRY_RESETWAITHIGH;
 	do {
 		if((retryCount = retryCount - 1) == 0) {
+			interrupts();
 			return false;
 		}
 
@@ -106,6 +134,9 @@ bool InterfaceOneWire::resetAndPresenceDetection() {
 		Pull line low for 480us, the minimum amount of time
 		(the delay of function calls will lead to a slightly larger time)
 	*/
+	#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+		noInterrupts();
+	#endif
 	pinLow();
 	pinModeOutput();
 	interrupts(); 							/* Allow interrupts during wait, the delay is not so critical; Just ensure ISRs
@@ -113,10 +144,33 @@ bool InterfaceOneWire::resetAndPresenceDetection() {
 	delayMicroseconds(480);
 	/* Now try to detect if any device set's the presence pulse ... */
 	noInterrupts();
+	#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+		releaseTime = microsAligned();		/* Release right after a micros() step; only extends the reset pulse */
+	#endif
 	pinModeInput();
-	delayMicroseconds(60); 					/* Wait for the devices to set response; Devices take 15-60 us to assert the
+	#ifndef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+		delayMicroseconds(60); 				/* Wait for the devices to set response; Devices take 15-60 us to assert the
 											   line for another 60-240 us (i.e. between 75 us and 300 us is  the "end") */
-	result = pinRead();
+		result = pinRead();
+	#else
+		/*
+			Wait for the presence pulse with interrupts enabled and only
+			disable them around the sample point. If an ISR delayed the
+			sample beyond ONEWIRE_RESET_TPRESENCE_MAX the presence pulse
+			may already have ended and the reset is flagged as preempted.
+		*/
+		interrupts();
+		do {
+			releaseElapsed = micros() - releaseTime;
+		} while(releaseElapsed < ONEWIRE_RESET_TPRESENCE_MIN);
+		noInterrupts();
+		result = pinRead();
+		releaseElapsed = micros() - releaseTime;
+		interrupts();
+		if(releaseElapsed + ONEWIRE_MICROS_STEP > ONEWIRE_RESET_TPRESENCE_MAX) {
+			this->slotPreempted = true;
+		}
+	#endif
 	interrupts(); 							/* Allow interrupts during second wait. Timing is nearly irrelevant if extended ... */
 	delayMicroseconds(420);
 
@@ -250,6 +304,138 @@ void InterfaceOneWire::romCommand_ROMBroadcast() {
 	}
 #endif
 
+#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+	/*
+		Preemption detection. The flag is only set by writeBit and
+		resetAndPresenceDetection and only cleared by the application (or runTransaction)
+	*/
+	bool InterfaceOneWire::preemptionDetected() {
+		return this->slotPreempted;
+	}
+	void InterfaceOneWire::preemptionClear() {
+		this->slotPreempted = false;
+	}
+
+	/*
+		Run a transaction and repeat it as long as slots have been
+		preempted (at most ONEWIRE_PREEMPTION_RETRIES times)
+	*/
+	bool InterfaceOneWire::runTransaction(lpfnInterfaceOneWire_Transaction transaction, void* lpFreeParam) {
+		uint8_t retries = ONEWIRE_PREEMPTION_RETRIES;
+		bool result;
+
+		if(transaction == NULL) {
+			return false;
+		}
+
+		for(;;) {
+			this->slotPreempted = false;
+			result = transaction(this, lpFreeParam);
+			if(!this->slotPreempted) {
+				return result;
+			}
+			if(retries == 0) {
+				return false;
+			}
+			retries = retries - 1;
+		}
+	}
+#endif
+
+/*
+	Read Power Supply. Parasitically powered devices pull the bus
+	low during the read slot following the command, externally powered
+	devices leave it high. Bus wide results are recorded in
+	recordedPowerMode, per device results in the power mode cache.
+*/
+uint8_t InterfaceOneWire::readPowerSupply(uint8_t* romAdress) {
+	uint8_t mode;
+	#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+		bool preemptedBefore = this->slotPreempted;
+		this->slotPreempted = false;
+	#endif
+
+	if(!romCommand_SelectOrBroadcast(romAdress)) {
+		mode = ONEWIRE_POWERMODE_UNKNOWN;
+	} else {
+		writeByte(0xB4, false);						// Read power supply
+		mode = (readBit() == 0) ? ONEWIRE_POWERMODE_PARASITIC : ONEWIRE_POWERMODE_EXTERNAL;
+	}
+
+	#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+		/*
+			A preempted Match ROM or command leaves the bus released which
+			would read as externally powered. Don't record such a result,
+			the preemption flag stays set for the caller.
+		*/
+		if(this->slotPreempted) {
+			return ONEWIRE_POWERMODE_UNKNOWN;
+		}
+		this->slotPreempted = preemptedBefore;
+	#endif
+
+	if(romAdress == NULL) {
+		this->recordedPowerMode = mode;
+	} else {
+		#if ONEWIRE_POWERMODE_CACHE_SIZE > 0
+			powerModeCacheStore(romAdress, mode);
+		#endif
+	}
+	return mode;
+}
+uint8_t InterfaceOneWire::busPowerMode() {
+	return this->recordedPowerMode;
+}
+
+/*
+	Issue a function command and wait for it's completion. Strong pullup
+	is only used if a parasitically powered device may be involved. Else
+	Convert T (0x44) and Recall E2 (0xB8) signal completion by releasing
+	the bus during read slots; for all other commands (like Copy Scratchpad)
+	no busy status is defined and we wait for maxDurationMs.
+*/
+bool InterfaceOneWire::commandAndWaitCompletion(uint8_t* romAdress, uint8_t command, unsigned int maxDurationMs, uint8_t powerMode) {
+	unsigned long startTime;
+
+	#if ONEWIRE_POWERMODE_CACHE_SIZE > 0
+		if((powerMode == ONEWIRE_POWERMODE_UNKNOWN) && (romAdress != NULL)) {
+			powerMode = powerModeCacheLookup(romAdress);
+		}
+	#endif
+	if(powerMode == ONEWIRE_POWERMODE_UNKNOWN) {
+		powerMode = this->recordedPowerMode;
+	}
+
+	if(!romCommand_SelectOrBroadcast(romAdress)) {
+		return false;
+	}
+
+	if(powerMode != ONEWIRE_POWERMODE_EXTERNAL) {
+		/*
+			The strong pullup drives the bus as soon as writeByte returns
+			so interrupts can be enabled again during the wait
+		*/
+		writeByte(command, true);
+		interrupts();
+		delay(maxDurationMs);
+		activePullupDisable();
+		return true;
+	}
+
+	writeByte(command, false);
+	if((command != 0x44) && (command != 0xB8)) {
+		delay(maxDurationMs);
+		return true;
+	}
+	startTime = millis();
+	while(readBit() == 0) {
+		if((millis() - startTime) > maxDurationMs) {
+			return false;
+		}
+	}
+	return true;
+}
+
 static uint8_t crcUpdate8(uint8_t crc, uint8_t data) {
 	uint8_t i;
 	crc = crc ^ data;
@@ -317,6 +503,57 @@ bool InterfaceOneWire::crc8CheckIButton(uint8_t* lpData, unsigned int dwLen, uin
 	=========================
 */
 
+/*
+	Reset the bus and select the device with the given ROM adress or
+	all devices if romAdress is NULL. Returns false if no device
+	signaled presence.
+*/
+bool InterfaceOneWire::romCommand_SelectOrBroadcast(uint8_t* romAdress) {
+	if(!resetAndPresenceDetection()) {
+		return false;
+	}
+	if(romAdress == NULL) {
+		writeByte(0xCC, false);						// Skip ROM command
+	} else {
+		writeByte(0x55, false);						// Match ROM command
+		writeBytes(romAdress, 8, false);
+	}
+	return true;
+}
+
+#if ONEWIRE_POWERMODE_CACHE_SIZE > 0
+	/*
+		Per device power mode cache. Entries are located by their ROM
+		adress; if a new device does not fit the oldest entry is replaced.
+	*/
+	uint8_t InterfaceOneWire::powerModeCacheLookup(uint8_t* romAdress) {
+		uint8_t i;
+		for(i = 0; i < ONEWIRE_POWERMODE_CACHE_SIZE; i=i+1) {
+			if((this->powerModeCacheMode[i] != ONEWIRE_POWERMODE_UNKNOWN) && (memcmp(this->powerModeCacheRom[i], romAdress, 8) == 0)) {
+				return this->powerModeCacheMode[i];
+			}
+		}
+		return ONEWIRE_POWERMODE_UNKNOWN;
+	}
+	void InterfaceOneWire::powerModeCacheStore(uint8_t* romAdress, uint8_t mode) {
+		uint8_t i;
+		for(i = 0; i < ONEWIRE_POWERMODE_CACHE_SIZE; i=i+1) {
+			if(memcmp(this->powerModeCacheRom[i], romAdress, 8) == 0) {
+				this->powerModeCacheMode[i] = mode;
+				return;
+			}
+		}
+		if(mode == ONEWIRE_POWERMODE_UNKNOWN) {
+			return;
+		}
+
+		i = this->powerModeCacheNext;
+		memcpy(this->powerModeCacheRom[i], romAdress, 8);
+		this->powerModeCacheMode[i] = mode;
+		this->powerModeCacheNext = (i + 1) % ONEWIRE_POWERMODE_CACHE_SIZE;
+	}
+#endif
+
 #ifdef ONEWIRE_SUPPORT_ENUMERATION
 	/*
 		This routine performs the recursive onewire search. It may
@@ -421,36 +658,90 @@ bool InterfaceOneWire::crc8CheckIButton(uint8_t* lpData, unsigned int dwLen, uin
 		- After the write a short time will allow the bus to recovery via pullup (5 us)
 		  or active pullup will be enabled.
 */
-void InterfaceOneWire::writeBit(uint8_t value, bool keepInterruptsDisabled) {
-	if(value != 0) {
-		noInterrupts();
-		/* Pull line low for ~ 10 us (< 15 us) */
-		pinLow();
-		pinModeOutput();
-		delayMicroseconds(10);
-		/* Pull high the remaining timeslot (50 us) */
-		pinHigh();
-		delayMicroseconds(55);
-		/* Set drivers floating again */
-		pinModeInput();
-		if(!keepInterruptsDisabled) {
+#ifndef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+	void InterfaceOneWire::writeBit(uint8_t value, bool keepInterruptsDisabled) {
+		if(value != 0) {
+			noInterrupts();
+			/* Pull line low for ~ 10 us (< 15 us) */
+			pinLow();
+			pinModeOutput();
+			delayMicroseconds(10);
+			/* Pull high the remaining timeslot (50 us) */
+			pinHigh();
+			delayMicroseconds(55);
+			/* Set drivers floating again */
+			pinModeInput();
+			if(!keepInterruptsDisabled) {
+				interrupts();
+			}
+		} else {
+			noInterrupts();
+			/* Pull low for whole timeslot */
+			pinLow();
+			pinModeOutput();
+			delayMicroseconds(65);
+			/* Allow a 5 us charging interval for parasitic devices */
+			pinHigh();
+			delayMicroseconds(5);
+			pinModeInput();
+			if(!keepInterruptsDisabled) {
+				interrupts();
+			}
+		}
+	}
+#else
+	/*
+		Minimal critical section variant. Interrupts are only disabled
+		while the line is pulled low for a '1' and while the port
+		registers are modified. The low phase of a '0' runs with
+		interrupts enabled; we poll micros() until the nominal low time
+		has passed so an ISR only stretches the slot if it's still running
+		at the end of the low phase. If the low phase exceeded
+		ONEWIRE_SLOT_TLOW0_MAX the slot is flagged as preempted.
+	*/
+	void InterfaceOneWire::writeBit(uint8_t value, bool keepInterruptsDisabled) {
+		unsigned long slotStart;
+		unsigned long slotLow;
+
+		if(value != 0) {
+			noInterrupts();
+			/* Pull line low for ~ 10 us (< 15 us) */
+			pinLow();
+			pinModeOutput();
+			delayMicroseconds(10);
+			/* Pull high the remaining timeslot; not timing critical */
+			pinHigh();
+			interrupts();
+			delayMicroseconds(55);
+		} else {
+			noInterrupts();
+			/* Pull low for whole timeslot */
+			pinLow();
+			slotStart = microsAligned();
+			pinModeOutput();
+			interrupts();
+			do {
+				slotLow = micros() - slotStart;
+			} while(slotLow < ONEWIRE_SLOT_TLOW0);
+			noInterrupts();
+			pinHigh();
+			slotLow = micros() - slotStart;
 			interrupts();
+			if(slotLow + ONEWIRE_MICROS_STEP > ONEWIRE_SLOT_TLOW0_MAX) {
+				this->slotPreempted = true;
+			}
+			/* Allow a 5 us charging interval for parasitic devices */
+			delayMicroseconds(5);
 		}
-	} else {
+
+		/* Set drivers floating again */
 		noInterrupts();
-		/* Pull low for whole timeslot */
-		pinLow();
-		pinModeOutput();
-		delayMicroseconds(65);
-		/* Allow a 5 us charging interval for parasitic devices */
-		pinHigh();
-		delayMicroseconds(5);
 		pinModeInput();
 		if(!keepInterruptsDisabled) {
 			interrupts();
 		}
 	}
-}
+#endif
 
 /*
 	Read a single bit from the 1-wire bussystem.
@@ -458,6 +749,9 @@ void InterfaceOneWire::writeBit(uint8_t value, bool keepInterruptsDisabled) {
 	The read is initiated by pulling the data line low for approx. 6 us
 	After additional 9 us (we round up to 10 us) the master should sample again
 	The remaining 55 us of the timeslot & recovery period the master sleeps
+
+	Interrupts are only disabled up to the sample point so this is
+	also used unchanged with ONEWIRE_MINIMAL_CRITICAL_SECTIONS
 */
 uint8_t InterfaceOneWire::readBit() {
 	uint8_t result;
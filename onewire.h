@@ -26,6 +26,17 @@
 			If set overdrive mode is supported via
 			appropriate function calls. Note that
 			overdrive support is CURRENTLY NOT IMPLEMENTED!
+
+		ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+			If defined the low phase of a '0' write slot,
+			the recovery phase of a '1' write slot as well
+			as the idle wait and presence wait of a bus
+			reset run with interrupts enabled. The '0' low
+			phase and the presence sample point are timed
+			via micros(). If an ISR stretched them out of
+			specification the preemption flag is set and
+			the transaction can be repeated (see
+			runTransaction). Read slots are not affected.
 */
 
 #define ONEWIRE_SUPPORT_ENUMERATION 1
@@ -50,6 +61,68 @@
 	#define ONEWIRE_RETRY_RESETWAITHIGH 200
 #endif
 
+/*
+	ONEWIRE_SLOT_TLOW0 is the nominal low time of a '0' write slot,
+	ONEWIRE_SLOT_TLOW0_MAX the maximum low time (in us) that is
+	tolerated before the slot is considered preempted. Only used
+	with ONEWIRE_MINIMAL_CRITICAL_SECTIONS.
+
+	ONEWIRE_RESET_TPRESENCE_MIN is the earliest time (in us) after
+	releasing the reset pulse at which every device asserts the
+	presence pulse (60 us), ONEWIRE_RESET_TPRESENCE_MAX the latest
+	time at which it's guaranteed to be still asserted (15 us + 60 us).
+
+	ONEWIRE_MICROS_STEP is the resolution of micros() in us (64 timer
+	clocks; 4 us at 16 MHz, 8 us at 8 MHz). Timestamps are taken right
+	after a step so measured times never exceed the real ones; the
+	maximum checks add one step so they never miss a late slot. With
+	8 us steps this may flag a few slots that have been in time.
+
+	ONEWIRE_PREEMPTION_RETRIES defines how often runTransaction
+	repeats a transaction that has been preempted.
+*/
+#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+	#ifndef ONEWIRE_SLOT_TLOW0
+		#define ONEWIRE_SLOT_TLOW0 65
+	#endif
+	#ifndef ONEWIRE_SLOT_TLOW0_MAX
+		#define ONEWIRE_SLOT_TLOW0_MAX 120
+	#endif
+	#ifndef ONEWIRE_RESET_TPRESENCE_MIN
+		#define ONEWIRE_RESET_TPRESENCE_MIN 60
+	#endif
+	#ifndef ONEWIRE_RESET_TPRESENCE_MAX
+		#define ONEWIRE_RESET_TPRESENCE_MAX 75
+	#endif
+	#ifndef ONEWIRE_MICROS_STEP
+		#ifdef F_CPU
+			#define ONEWIRE_MICROS_STEP ((64000000UL + F_CPU - 1) / F_CPU)
+		#else
+			#define ONEWIRE_MICROS_STEP 8
+		#endif
+	#endif
+	#ifndef ONEWIRE_PREEMPTION_RETRIES
+		#define ONEWIRE_PREEMPTION_RETRIES 3
+	#endif
+#endif
+
+/*
+	Power modes as reported by readPowerSupply and recorded
+	for the whole bus.
+*/
+#define ONEWIRE_POWERMODE_UNKNOWN		0
+#define ONEWIRE_POWERMODE_EXTERNAL		1
+#define ONEWIRE_POWERMODE_PARASITIC		2
+
+/*
+	ONEWIRE_POWERMODE_CACHE_SIZE defines for how many devices the
+	power mode reported by readPowerSupply is remembered (9 bytes
+	of RAM per entry). Set to 0 to disable the per device cache.
+*/
+#ifndef ONEWIRE_POWERMODE_CACHE_SIZE
+	#define ONEWIRE_POWERMODE_CACHE_SIZE 4
+#endif
+
 /*
 	Definition for the disovered device callback. This callback
 	is called during bus search for every located ROM ID. The
@@ -59,6 +132,21 @@ typedef void (*lpfnInterfaceOneWire_DiscoveredDevice)(
 	uint8_t* romId
 );
 
+#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+	class InterfaceOneWire;
+
+	/*
+		Definition for a transaction callback used by runTransaction.
+		The callback performs a complete transaction (starting with a
+		ROM command) and returns true on success. The free parameter
+		is passed through unchanged.
+	*/
+	typedef bool (*lpfnInterfaceOneWire_Transaction)(
+		InterfaceOneWire* lpInterface,
+		void* lpFreeParam
+	);
+#endif
+
 class InterfaceOneWire {
 	public:
 		/*
@@ -128,6 +216,27 @@ class InterfaceOneWire {
 		*/
 		uint8_t readBit();
 
+		#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+			/*
+				Returns true if any write slot or presence detection
+				since the last call to preemptionClear() has been
+				stretched by an ISR beyond ONEWIRE_SLOT_TLOW0_MAX or
+				ONEWIRE_RESET_TPRESENCE_MAX. The data transferred
+				since then is not reliable and the transaction has
+				to be repeated.
+			*/
+			bool preemptionDetected();
+			void preemptionClear();
+
+			/*
+				Execute the transaction callback and repeat it up to
+				ONEWIRE_PREEMPTION_RETRIES times if a slot has been
+				preempted. Returns the callbacks result or false if
+				every attempt has been preempted.
+			*/
+			bool runTransaction(lpfnInterfaceOneWire_Transaction transaction, void* lpFreeParam);
+		#endif
+
 		#ifdef ONEWIRE_SUPPORT_ENUMERATION
 			/*
 				Perform a 1-wire ROM search. For every found device the
@@ -155,12 +264,50 @@ class InterfaceOneWire {
 			void romCommand_ROMSelectOverdrive(uint8_t* romAdress);
 		#endif
 
+		/*
+			Issue Read Power Supply (0xB4) either to the device with the given
+			ROM adress or (if romAdress is NULL) to all devices on the bus. Returns
+			ONEWIRE_POWERMODE_PARASITIC if any addressed device is parasitically
+			powered, ONEWIRE_POWERMODE_EXTERNAL if all are externally powered or
+			ONEWIRE_POWERMODE_UNKNOWN if no device is present. The result of a
+			bus wide query (including UNKNOWN) is recorded and can be fetched via
+			busPowerMode(). The result of a per device query is remembered in a
+			cache of ONEWIRE_POWERMODE_CACHE_SIZE devices. With
+			ONEWIRE_MINIMAL_CRITICAL_SECTIONS a preempted query returns
+			ONEWIRE_POWERMODE_UNKNOWN and is not recorded.
+		*/
+		uint8_t readPowerSupply(uint8_t* romAdress);
+		uint8_t busPowerMode();
+
+		/*
+			Select the device with the given ROM adress (or all devices if romAdress
+			is NULL), issue a function command like Convert T (0x44), Copy Scratchpad
+			(0x48) or Recall E2 (0xB8) and wait for it's completion.
+
+			If powerMode is ONEWIRE_POWERMODE_UNKNOWN the cached mode of the addressed device
+			is used, else the recorded bus power mode. If a device is neither cached nor the
+			bus mode is known the caller should pass the devices power mode explicitly. For
+			parasitic (or still unknown) power the strong pullup is held for maxDurationMs
+			milliseconds; interrupts are enabled during this wait. For externally powered
+			devices Convert T (0x44) and Recall E2 (0xB8) are completed by polling read
+			slots till the device signals completion or maxDurationMs have passed. All
+			other commands define no busy status, for them maxDurationMs is always waited. Returns false on timeout or if no device is present.
+		*/
+		bool commandAndWaitCompletion(uint8_t* romAdress, uint8_t command, unsigned int maxDurationMs, uint8_t powerMode);
+
 		bool crc8CheckIButton(uint8_t* lpData, unsigned int dwLen, uint8_t crcToCheck); /* Performs a CRC check on the given data */
 	private:
 		#ifdef ONEWIRE_SUPPORT_ENUMERATION
 			void discoveryDevicesRecursive(uint8_t level, bool alarmSearch); /* This routine is used during recursive lookup */
 		#endif
 
+		bool romCommand_SelectOrBroadcast(uint8_t* romAdress);				/* Reset and select a device (or all if romAdress is NULL); returns presence */
+
+		#if ONEWIRE_POWERMODE_CACHE_SIZE > 0
+			uint8_t powerModeCacheLookup(uint8_t* romAdress);
+			void powerModeCacheStore(uint8_t* romAdress, uint8_t mode);
+		#endif
+
 		/*
 			Here we keep the references to our I/O and optionally active pullup registers.
 			The I/O register is the only onewire register directly used for input, output
@@ -183,6 +330,17 @@ class InterfaceOneWire {
 			uint8_t					pullupRegisterMask;
 		#endif
 
+		#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+			volatile bool			slotPreempted;		/* Set whenever a write slot or presence detection exceeded its timing window */
+		#endif
+
+		uint8_t						recordedPowerMode;			/* Power mode of the whole bus as recorded by the last bus wide readPowerSupply */
+		#if ONEWIRE_POWERMODE_CACHE_SIZE > 0
+			uint8_t					powerModeCacheRom[ONEWIRE_POWERMODE_CACHE_SIZE][8];		/* ROM adresses of devices with known power mode */
+			uint8_t					powerModeCacheMode[ONEWIRE_POWERMODE_CACHE_SIZE];		/* Power modes of these devices */
+			uint8_t					powerModeCacheNext;										/* Next entry to be replaced */
+		#endif
+
 		/*
 			State variables used by bus enumeration.
 		*/
@@ -207,6 +365,10 @@ class InterfaceOneWire {
 
 		inline void pinModeInput() 			{ ioRegister[1] = ioRegister[1] & (~ioRegisterMask); pinLow();	}
 		inline void pinModeOutput() 		{ ioRegister[1] = ioRegister[1] | ioRegisterMask; 				}
+
+		#ifdef ONEWIRE_MINIMAL_CRITICAL_SECTIONS
+			inline unsigned long microsAligned()	{ unsigned long t = micros(); unsigned long n; while((n = micros()) == t) { } return n; }	/* Wait for the next micros() step and return it's value */
+		#endif
 		
 		#ifdef ONEWIRE_ACTIVE_PULLUP
 			inline void pullupInitialize() 	{ pullupRegister[1] = pullupRegister[1] | pullupRegisterMask; pullupRegister[2] = pullupRegister[2] & (~pullupRegisterMask); } 		/* Set mode to output, disable active pullup */